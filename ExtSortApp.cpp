@@ -2,22 +2,98 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
 #include <ctime>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <list>
 #include <sstream>
 #include <system_error>
+#include <unordered_map>
+#include <vector>
 
 #include "ExtSortApp.hpp"
 #include <utils/utils.hpp>
 
+#ifdef _MSC_VER
+#include <share.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+// Sets a user-defined buffer to a file stream, must be called before the first I/O operation.
+template <class Stream>
+static void setStreamBuffer(Stream& stream, std::vector<char>& buffer)
+{
+	if (!buffer.empty())
+		stream.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+}
+
+// File stream closed by its destructor, which a stream built on a FILE does not do with MSVC.
+template <class Stream>
+class ClosingStream : public Stream
+{
+public:
+	using Stream::Stream;
+	~ClosingStream() { if (this->is_open()) this->close(); }
+};
+
+// Opens a file stream with the access hints of the CRT: 'S' sequential scan, 'R' random access and
+// 'T' short-lived file. The file is shared with other processes like a stream opened by path.
+template <class Stream>
+static ClosingStream<Stream> openStream(const std::filesystem::path& path, [[maybe_unused]] const wchar_t* mode, std::ios_base::openmode openmode)
+{
+#ifdef _MSC_VER
+	if (FILE* fp = _wfsopen(path.c_str(), mode, _SH_DENYNO); fp != nullptr)
+		return ClosingStream<Stream>(fp);
+#endif
+	return ClosingStream<Stream>(path, openmode);
+}
+
+// Tells if two keys are equal for the SORT command, which compares them without case sensitivity
+// using the collation of the system locale.
+static bool sameKey(const std::string& key1, const std::string& key2)
+{
+	if (key1 == key2)
+		return true;
+#ifdef _WIN32
+	auto widen = [](const std::string& key)
+	{
+		auto len = static_cast<int>(key.size());
+		std::wstring wide(MultiByteToWideChar(CP_ACP, 0, key.data(), len, nullptr, 0), L'\0');
+		MultiByteToWideChar(CP_ACP, 0, key.data(), len, wide.data(), static_cast<int>(wide.size()));
+		return wide;
+	};
+	auto wkey1 = widen(key1);
+	auto wkey2 = widen(key2);
+	return CompareStringEx(LOCALE_NAME_SYSTEM_DEFAULT, NORM_IGNORECASE, wkey1.data(), static_cast<int>(wkey1.size()),
+		wkey2.data(), static_cast<int>(wkey2.size()), nullptr, nullptr, 0) == CSTR_EQUAL;
+#else
+	return to_lower(key1) == to_lower(key2);
+#endif
+}
+
+// Quotes a path for the command line. A trailing separator would escape the closing quote, so '.' is
+// appended to it, ie. "D:\." for the root of a drive.
+static std::string quotePath(const std::filesystem::path& path)
+{
+	auto str = std::filesystem::path(path).make_preferred().string();
+	if (!str.empty() && (str.back() == '\\' || str.back() == '/'))
+		str.push_back('.');
+	return "\"" + str + "\"";
+}
+
 void ExtSortApp::SetUsage()
 {
 	us.description = "Sorts file(s) by given keys.";
 	us.set_syntax("ExtSort.exe " + FILE_ARG + " [/o:" + EXTENSION_ARG + "] [/n:" + DECIMAL_ARG + "] [/d:" + DATEFMT_ARG + "]\n"
 		"                ([/s:" + FIELDSEP_ARG + "] /p:" + FIELDPOS_ARG + " | /f:" + FIXED_ARG + ") [/r] [/b:" + BEGIN_ARG + "]\n"
-		"                [/double] [/i]");
+		"                [/double] [/i] [/u [/l]] [/t:" + TEMPDIR_ARG + "] [/m:" + BUFFER_ARG + "]\n"
+		"                [/k:" + SORTMEM_ARG + "]");
 	
 	Unnamed_Arg file{ FILE_ARG };
 	file.many = true;
@@ -93,7 +169,39 @@ void ExtSortApp::SetUsage()
 	i.helpstring = "Ignore overflow errors.";
 	us.add_Argument(i);
 	
+	Named_Arg u{ UNIQUE_ARG };
+	u.switch_char = 'u';
+	u.set_type(Argument_Type::simple);
+	u.helpstring = "Keep only one record for each key.";
+	us.add_Argument(u);
+	
+	Named_Arg l{ LAST_ARG };
+	l.switch_char = 'l';
+	l.set_type(Argument_Type::simple);
+	l.helpstring = "Keep the last record of each key instead of the first.";
+	us.add_Argument(l);
+	
+	Named_Arg t{ TEMPDIR_ARG };
+	t.switch_char = 't';
+	t.set_type(Argument_Type::string);
+	t.helpstring = "Directory where the temporary files are created.";
+	us.add_Argument(t);
+	
+	Named_Arg m{ BUFFER_ARG };
+	m.switch_char = 'm';
+	m.set_type(Argument_Type::string);
+	m.helpstring = "Size in KB of the I/O buffers.";
+	us.add_Argument(m);
+	
+	Named_Arg k{ SORTMEM_ARG };
+	k.switch_char = 'k';
+	k.set_type(Argument_Type::string);
+	k.helpstring = "Maximum memory in KB used by the SORT command and\n"
+		"to remove duplicates before the sort.";
+	us.add_Argument(k);
+	
 	us.add_requirement(s.name(), p.name());
+	us.add_requirement(l.name(), u.name());
 	us.add_conflict(p.name(), f.name());
 	
 	us.usage = "A date field position must be preceded by the 'D' char and a numeric field\n"
@@ -112,6 +220,29 @@ void ExtSortApp::SetUsage()
 		"simple precision with double values.\n"
 		"An error still occurs if the length of the exponent is greater that 2 digits\n"
 		"without using double float precision.\n\n"
+		"Records with the same key are written in the order of the input file. With the\n"
+		"option /u only the first record of each key is written, or the last one if the\n"
+		"option /l is also used. Two keys are duplicates if they are equal for the SORT\n"
+		"command, which compares them without case sensitivity using the system locale.\n"
+		"A part of the duplicates is removed before the sort, which reduces the temporary\n"
+		"space. The memory used for this is limited by the option /k, or to 16384 KB by\n"
+		"default.\n\n"
+		"By default the temporary files are created in the directory of the input file.\n"
+		"The option /t allows to create them on another drive, so that the reading of\n"
+		"the input file and the writing of the indexes do not compete for the same disk.\n"
+		"This directory is also given to the SORT command for its own temporary files.\n\n"
+		"The option /m sets the size of the buffers used for the sequential accesses: the\n"
+		"reading of the input file to build the indexes, the writing and the reading of\n"
+		"the indexes and the writing of the output file. The records are read back from\n"
+		"the input file with a default buffer, since they are accessed randomly.\n"
+		"The size of the buffers is limited to 16384 KB.\n\n"
+		"The input file is opened with a sequential scan hint while the indexes are built,\n"
+		"so that the system cache reads ahead and releases the scanned pages sooner, and\n"
+		"with a random access hint while the records are read back, so that no useless\n"
+		"data is read ahead. The index file is opened as a short-lived file, it is not\n"
+		"flushed to the disk if there is enough memory.\n"
+		"The option /k limits the memory used by the SORT command, by default it may use\n"
+		"most of the available memory. The value is limited to 1048576 KB.\n\n"
 		"Examples:\n\n"
 		"ExtSort foo.txt /p:2,D5 /b:8\n"
 		"    Creates the file foo.sor.txt ordered from the 8th line based on 2nd and 5th\n"
@@ -120,7 +251,14 @@ void ExtSortApp::SetUsage()
 		"ExtSort foo.txt /f:35L5,N3L8 /r\n"
 		"    Creates the file foo.sor.txt ordered from the 1st line based on 2 fields.\n"
 		"    The 1st field starts at position 35 with length 5 and the 2nd starts at\n"
-		"    position 3 with length 8. The 2nd field is sorted by numerical values.\n";
+		"    position 3 with length 8. The 2nd field is sorted by numerical values.\n\n"
+		"ExtSort foo.txt /p:1 /u /l\n"
+		"    Creates the file foo.sor.txt ordered based on the 1st field, keeping only the\n"
+		"    last record of the input file for each value of this field.\n\n"
+		"ExtSort foo.txt /p:2 /t:D:\\Temp /m:1024\n"
+		"    Creates the file foo.sor.txt ordered based on the 2nd field. The temporary\n"
+		"    files are created in D:\\Temp and the sequential reads and writes are done\n"
+		"    by blocks of 1 MB.\n";
 }
 
 std::string ExtSortApp::CheckArguments()
@@ -198,6 +336,40 @@ std::string ExtSortApp::CheckArguments()
 	if (!ign->value.empty() && ign->value.front() == "true")
 		ignore_overflow = true;
 
+	auto uni = us.get_Argument(UNIQUE_ARG);
+	if (!uni->value.empty() && uni->value.front() == "true")
+		unique = true;
+
+	auto last = us.get_Argument(LAST_ARG);
+	if (!last->value.empty() && last->value.front() == "true")
+		keep_last = true;
+
+	auto tmpd = us.get_Argument(TEMPDIR_ARG);
+	if (!tmpd->value.empty() && !tmpd->value.front().empty())
+	{
+		tempDir = tmpd->value.front();
+		std::error_code ec;
+		if (!std::filesystem::is_directory(tempDir, ec))
+			return "Temporary directory '" + tmpd->value.front() + "' is" + HELP_MESSAGE;
+	}
+
+	auto bufs = us.get_Argument(BUFFER_ARG);
+	if (!bufs->value.empty())
+	{
+		auto bufv = bufs->value.front();
+		if (!CheckKilobytes(bufv, MAX_BUFFER_KB, bufferSize))
+			return "Buffer size '" + bufv + "' is" + HELP_MESSAGE;
+		bufferSize *= 1024;
+	}
+
+	auto smem = us.get_Argument(SORTMEM_ARG);
+	if (!smem->value.empty())
+	{
+		auto smemv = smem->value.front();
+		if (!CheckKilobytes(smemv, MAX_SORTMEM_KB, sortMemory))
+			return "Sort memory '" + smemv + "' is" + HELP_MESSAGE;
+	}
+
 	return "";				// all is okay
 }
 
@@ -208,6 +380,9 @@ void ExtSortApp::MainProcess(const std::filesystem::path& file)
 	static const unsigned long long DEFAULT_INCREMENT = 1000;
 	static const unsigned long long AVER_ROW_LEN = 120;
 
+	// initialize I/O buffers, declared first so that they outlive the streams using them
+	std::vector<char> inbuf(bufferSize), outbuf(bufferSize), tmpbuf(bufferSize), sortbuf(bufferSize);
+
 	// initialize input file
 	auto fsize = std::filesystem::file_size(file);
 	auto EOL_type = file_EOL(file);
@@ -215,23 +390,29 @@ void ExtSortApp::MainProcess(const std::filesystem::path& file)
 	char EOL_delim = '\n';
 	if (EOL_type == EOL::Mac)
 		EOL_delim = '\r';
-	std::ifstream infile(file, std::ios::binary);
+	auto infile = openStream<std::ifstream>(file, L"rbS", std::ios::binary);
+	setStreamBuffer(infile, inbuf);
 	std::uintmax_t lineCnt{ 0 };
 	
 	// initialize output file
 	auto outpath = getOutPath(file);
 	if (std::filesystem::exists(outpath))
 		std::filesystem::remove(outpath);
-	std::ofstream outfile(outpath, std::ios_base::out | std::ios::binary);
+	auto outfile = openStream<std::ofstream>(outpath, L"wbS", std::ios_base::out | std::ios::binary);
+	setStreamBuffer(outfile, outbuf);
 	std::uintmax_t outCnt{ 0 };
 	
-	// initialize temp output file
-	std::string tmpname{ file.generic_string() };
+	// initialize temp output file, in the directory of the input file if no temporary directory is given
+	std::filesystem::path tmppath{ file };
+	if (!tempDir.empty())
+		tmppath = tempDir / file.filename();
+	std::string tmpname{ tmppath.generic_string() };
 	tmpname.append(".tmp");
-	std::filesystem::path tmppath(tmpname);
+	tmppath = tmpname;
 	if (std::filesystem::exists(tmppath))
 		std::filesystem::remove(tmppath);
-	std::ofstream tmpfile(tmppath, std::ios_base::out);
+	auto tmpfile = openStream<std::ofstream>(tmppath, L"wTS", std::ios_base::out);
+	setStreamBuffer(tmpfile, tmpbuf);
 	std::uintmax_t tmpCnt{ 0 };
 
 	// initialize temp input file
@@ -253,6 +434,21 @@ void ExtSortApp::MainProcess(const std::filesystem::path& file)
 	}
 
 	// index creation
+	// offsets are padded with zeros so that records with the same key stay sorted by position
+	auto offsetWidth = std::to_string(fsize).length();
+	auto writeIndex = [&](const std::string& key, long long pos)
+	{
+		tmpfile << key << '\t' << std::setw(static_cast<int>(offsetWidth)) << std::setfill('0') << pos << "\n";
+		tmpCnt++;
+	};
+	// with /u the most recently read keys are kept with their offset, so that the duplicates found among
+	// them are dropped before the sort; a key is written to the index file when it leaves the cache,
+	// whose memory is limited like the one of the SORT command
+	static const size_t KEY_ENTRY_OVERHEAD = 128;		// estimated size of the list and hash table nodes
+	size_t cacheLimit = (sortMemory != 0 ? sortMemory : DEFAULT_KEYCACHE_KB) * 1024;
+	size_t cacheUsed{ 0 };
+	std::list<std::pair<std::string, long long>> keyCache;		// most recently read key first
+	std::unordered_map<std::string, decltype(keyCache)::iterator> keyLookup;
 	long long currPos = infile.tellg();
 	unsigned long long increment;
 	if ((increment = ((fsize / AVER_ROW_LEN / 100) / DEFAULT_INCREMENT) * DEFAULT_INCREMENT) < DEFAULT_INCREMENT)
@@ -333,62 +529,131 @@ void ExtSortApp::MainProcess(const std::filesystem::path& file)
 					}
 				}
 			}
-			tmpfile << key << '\t' << currPos << "\n";
-			tmpCnt++;
+			if (!unique)
+				writeIndex(key, currPos);
+			else if (auto found = keyLookup.find(key); found != keyLookup.end())
+			{
+				if (keep_last)		// same key as a cached record, only the last one is kept
+					found->second->second = currPos;
+				keyCache.splice(keyCache.begin(), keyCache, found->second);
+			}
+			else
+			{
+				auto entrySize = 2 * key.size() + KEY_ENTRY_OVERHEAD;
+				while (!keyCache.empty() && cacheUsed + entrySize > cacheLimit)
+				{
+					writeIndex(keyCache.back().first, keyCache.back().second);
+					cacheUsed -= 2 * keyCache.back().first.size() + KEY_ENTRY_OVERHEAD;
+					keyLookup.erase(keyCache.back().first);
+					keyCache.pop_back();
+				}
+				cacheUsed += entrySize;
+				keyCache.emplace_front(key, currPos);
+				keyLookup[key] = keyCache.begin();
+			}
 		}
 		if ((currPos = infile.tellg()) == -1)
 			currPos = fsize;
 		if (lineCnt % increment == 0 || !infile)
 			std::cout << "\rReading " << file.filename() << " : " << lineCnt << " lines (" << currPos * 100 / fsize << "%)";
 	}
+	for (const auto& [key, pos] : keyCache)
+		writeIndex(key, pos);
+	keyCache.clear();
+	keyLookup.clear();
 	std::cout << std::endl;
 	tmpfile.close();
+	infile.close();
 	// sort tmp file
 	std::cout << "Sort indexes..." << std::endl;
-	std::string command{ CMD_LINE + tmpname + " /O " + sortname };
+	std::string command{ CMD_LINE + quotePath(tmppath) + " /O " + quotePath(sortpath) };
+	if (!tempDir.empty())
+		command += " /T " + quotePath(tempDir);
+	if (sortMemory != 0)
+		command += " /M " + std::to_string(sortMemory);
 	auto ret = std::system(command.c_str());
 	std::filesystem::remove(tmppath);
 	if (ret != 0)
 		throw std::system_error(std::make_error_code(std::errc::interrupted), "Error while performing sort.");
 	// open sorted tmp file
 	fsize = std::filesystem::file_size(sortpath);
-	std::ifstream sortfile(sortpath);
+	auto sortfile = openStream<std::ifstream>(sortpath, L"rS", std::ios_base::in);
+	setStreamBuffer(sortfile, sortbuf);
 	std::uintmax_t sortCnt{ 0 };
 	// read sorted indexes and write matching lines of input file to output file
-	infile.clear();
+	// the input file is reopened with a default buffer, a large one would be refilled after each seek
+	auto gatherfile = openStream<std::ifstream>(file, L"rbR", std::ios::binary);
 	if ((increment = ((fsize / AVER_ROW_LEN / 100) / DEFAULT_INCREMENT) * DEFAULT_INCREMENT) < DEFAULT_INCREMENT)
 		increment = DEFAULT_INCREMENT;
+	std::string record;
+	auto writeRecord = [&](long long index)
+	{
+		gatherfile.seekg(index);
+		std::getline(gatherfile, record, EOL_delim);
+		if (record.length() != 0 && EOL_type == EOL::Windows)
+			if (record.back() == '\r')
+				record.pop_back();
+		outfile << record << EOL_str(EOL_type);
+		outCnt++;
+	};
+	std::string prevKey{};
+	long long prevPos{ -1 };
 	while (sortfile)
 	{
 		std::getline(sortfile, buf);
 		sortCnt++;
 		if (buf.length() != 0)
 		{
-			auto pos = buf.find('\t');
+			auto pos = buf.rfind('\t');
 			if (pos != std::string::npos)
 			{
 				long long index = stoll(buf.substr(pos + 1, buf.length() - pos));
-				infile.seekg(index);
-				std::getline(infile, buf, EOL_delim);
-				if (buf.length() != 0 && EOL_type == EOL::Windows)
-					if (buf.back() == '\r')
-						buf.pop_back();
-				outfile << buf << EOL_str(EOL_type);
-				outCnt++;
+				buf.resize(pos);			// keep only the key
+				if (!unique)
+					writeRecord(index);
+				else if (prevPos == -1 || !sameKey(buf, prevKey))
+				{
+					if (!keep_last)
+						writeRecord(index);
+					else if (prevPos != -1)
+						writeRecord(prevPos);
+					prevKey = buf;
+					prevPos = index;
+				}
+				else if (keep_last)		// same key as the previous index, only the last record is kept
+					prevPos = index;
 			}
 		}
+		if (!sortfile && keep_last && prevPos != -1)		// last key of the file
+		{
+			writeRecord(prevPos);
+			prevPos = -1;
+		}
 		if ((currPos = sortfile.tellg()) == -1)
 			currPos = fsize;
-		if (outCnt % increment == 0 || !sortfile)
+		if (sortCnt % increment == 0 || !sortfile)
 			std::cout << "\rWriting " << outpath.filename() << " : " << outCnt << " lines (" << currPos * 100 / fsize << "%)";
 	}
 	std::cout << "\n" << std::endl;
 	sortfile.close();
 	std::filesystem::remove(sortpath);
-	infile.close();
+	gatherfile.close();
 	outfile.close();
 }
 
+bool ExtSortApp::CheckKilobytes(const std::string& argvalue, size_t max_kb, size_t& kilobytes)
+{
+	// the length is checked first so that std::stoull cannot overflow
+	if (argvalue.empty() || argvalue.length() > std::to_string(max_kb).length()
+		|| std::find_if(argvalue.begin(), argvalue.end(), [](unsigned char c) {return !std::isdigit(c); }) != argvalue.end())
+		return false;
+	auto kb = std::stoull(argvalue);
+	if (kb > max_kb)
+		return false;
+	kilobytes = static_cast<size_t>(kb);
+	return true;
+}
+
 bool ExtSortApp::CheckDtFormat(const std::string& argvalue)
 {
 	dateFormat = argvalue;
@@ -36,6 +36,11 @@ public:
 	size_t begin{ 1 };
 	bool double_precision{ false };
 	bool ignore_overflow{ false };
+	bool unique{ false };
+	bool keep_last{ false };
+	std::filesystem::path tempDir{};
+	size_t bufferSize{ 0 };				// in bytes
+	size_t sortMemory{ 0 };				// in KB
 
 	// argument names of the application
 	const std::string FILE_ARG{ "file" };
@@ -49,6 +54,11 @@ public:
 	const std::string BEGIN_ARG{ "begin" };
 	const std::string DOUBLE_ARG{ "double" };
 	const std::string IGNORE_ARG{ "ignore" };
+	const std::string UNIQUE_ARG{ "unique" };
+	const std::string LAST_ARG{ "last" };
+	const std::string TEMPDIR_ARG{ "temp_dir" };
+	const std::string BUFFER_ARG{ "buffer" };
+	const std::string SORTMEM_ARG{ "sort_memory" };
 
 protected:
 	virtual void SetUsage() override;											// Defines expected arguments and help.
@@ -72,7 +82,12 @@ private:
 		value
 	};
 
+	static const size_t MAX_BUFFER_KB{ 16384 };
+	static const size_t MAX_SORTMEM_KB{ 1048576 };
+	static const size_t DEFAULT_KEYCACHE_KB{ 16384 };
+
 	bool CheckDtFormat(const std::string& argvalue);
+	bool CheckKilobytes(const std::string& argvalue, size_t max_kb, size_t& kilobytes);
 	bool AddFields(const std::string& argvalue, bool fixed = false);
 	std::string makeSortableStr(const double dbl);
 	std::string makeComplement(const std::string val, const NumberPart numPart);